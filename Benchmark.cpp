@@ -0,0 +1,67 @@
+/*
+Measures the cost of entering and exiting profiled scopes, with and without the inline fast path:
+c++ -std=c++17 -O2 -Iinclude Benchmark.cpp src/MMeter.cpp -o benchmark -pthread
+c++ -std=c++17 -O2 -DMMETER_INLINE_FAST_PATH=1 -Iinclude Benchmark.cpp src/MMeter.cpp -o benchmark-inline -pthread
+*/
+
+#include "MMeter.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <thread>
+
+constexpr int IterationCount = 10000000;
+constexpr int RunCount = 5;
+
+// Longer than the small string buffer, so looking it up by a temporary String would allocate
+constexpr const char *LongName = "a branch name longer than the small string buffer";
+
+// Only the tree bookkeeping, without reading the clock
+void pushPopScopes()
+{
+	auto treePtr = MMeter::getThreadLocalTreePtr();
+	for (int i = 0; i < IterationCount; i++)
+	{
+		treePtr->stackPush("outer");
+		treePtr->stackPush(LongName);
+		treePtr->stackPop();
+		treePtr->stackPop();
+	}
+}
+
+// Complete scopes, including the clock reads
+void profileScopes()
+{
+	for (int i = 0; i < IterationCount; i++)
+	{
+		MMETER_SCOPE_PROFILER("outer");
+		{
+			MMETER_SCOPE_PROFILER(LongName);
+		}
+	}
+}
+
+// Returns the best time per scope in ns
+template <class _FUNC_T> double measure(_FUNC_T func)
+{
+	double best = 0.0;
+	for (int run = 0; run < RunCount; run++)
+	{
+		std::thread([&]() {
+			auto startTime = std::chrono::steady_clock::now();
+			func();
+			std::chrono::duration<double, std::nano> duration = std::chrono::steady_clock::now() - startTime;
+			double perScope = duration.count() / (2.0 * IterationCount);
+			best = (run == 0) ? perScope : std::min(best, perScope);
+		}).join();
+	}
+	return best;
+}
+
+int main()
+{
+    std::cout << "MMETER_INLINE_FAST_PATH=" << MMETER_INLINE_FAST_PATH << std::endl;
+    std::cout << "stack push and pop: " << measure(pushPopScopes) << " ns/scope" << std::endl;
+    std::cout << "MMETER_SCOPE_PROFILER: " << measure(profileScopes) << " ns/scope" << std::endl;
+}
@@ -6,6 +6,15 @@
 #include <string>
 #include <thread>
 
+#if MMETER_SHARED_MEMORY == 1
+#include <cstdlib>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
 int calcInt(int ctr)
 {
 	MMETER_FUNC_PROFILER;
@@ -57,6 +66,107 @@ double calcAll(int ctr)
 	return (calcInt(ctr) + calcFloat(ctr));
 }
 
+// parseList and parseItem call each other, to test folding of indirect recursion
+int parseList(const std::string &text, std::size_t &pos);
+
+int parseItem(const std::string &text, std::size_t &pos)
+{
+	MMETER_FUNC_PROFILER;
+
+	if (text[pos] == '[')
+	{
+		return parseList(text, pos);
+	}
+	MMETER_COUNT("digits", 1);
+	return calcInt(text[pos++] * 10);
+}
+
+int parseList(const std::string &text, std::size_t &pos)
+{
+	MMETER_FUNC_PROFILER;
+
+	int sum = 0;
+	pos++;
+	while (text[pos] != ']')
+	{
+		sum += parseItem(text, pos);
+	}
+	pos++;
+	return sum;
+}
+
+// Calls itself beyond the max depth, to test collapsed scopes
+int nest(int depth)
+{
+	MMETER_FUNC_PROFILER;
+
+	return depth > 0 ? nest(depth - 1) : calcInt(1000000);
+}
+
+// A scope with a given name, optionally with a nested scope
+void namedScope([[maybe_unused]] const char *name, bool nested)
+{
+	MMETER_SCOPE_PROFILER(name);
+
+	if (nested)
+	{
+		calcInt(1000);
+	}
+}
+
+#if MMETER_SHARED_MEMORY == 1
+// Reads a branch back from the thread's segment, which a forked child mustn't remove
+bool checkSharedSegment()
+{
+	MMETER_SCOPE_PROFILER("shared subthread");
+	calcInt(1000);
+
+	auto headerPtr = MMeter::getThreadLocalTreePtr()->sharedSegment();
+	if (headerPtr == nullptr || headerPtr->slotCount.load() < 2)
+	{
+		return false;
+	}
+	// The running scope got the first slot, its finished subscope the second
+	auto &slot = MMeter::Shared::slots(headerPtr)[1];
+	if (std::string(slot.name) != "calcInt" || slot.parentIndex != 0 || slot.callCount.load() != 1)
+	{
+		return false;
+	}
+
+	std::cout.flush();
+	auto pid = fork();
+	if (pid == 0)
+	{
+		// Exit through the thread's destructors, like a worker process
+		std::exit(0);
+	}
+	waitpid(pid, nullptr, 0);
+
+	int fd = shm_open(MMeter::Shared::segmentName(getpid(), headerPtr->threadIndex).c_str(), O_RDONLY, 0);
+	if (fd < 0)
+	{
+		return false;
+	}
+	close(fd);
+	return true;
+}
+#endif
+
+// Every branch must measure at least as long as its subbranches together.
+// Nearly empty scopes can still measure a bit less, as their exit is counted as their chore
+bool checkDurations(const MMeter::FuncProfilerTree &tree)
+{
+	for (auto &nameBranchPair : tree.branches())
+	{
+		if (nameBranchPair.second.realNodeDuration().count() < -1e-3 || !checkDurations(nameBranchPair.second))
+		{
+			std::cerr << "Inconsistent duration of " << nameBranchPair.first << std::endl;
+			return false;
+		}
+	}
+	return true;
+}
+
 void test()
 {
 	MMETER_FUNC_PROFILER;
@@ -75,7 +185,110 @@ int main()
     });
     t1.join();
 
+    bool memoryReported = false;
+    std::thread t2([&]() {
+        MMeter::getThreadLocalTreePtr()->setRecursionFolding(true);
+        MMETER_SCOPE_PROFILER("recursion subthread");
+        std::string text = "[1[2[3a]b[c[d]]]4]";
+        for (int i = 0; i < 20000; i++)
+        {
+            std::size_t pos = 0;
+            parseList(text, pos);
+        }
+
+        // The usage of a running thread is visible from other threads
+        auto threadId = std::this_thread::get_id();
+        std::thread([&]() {
+            auto usages = MMeter::getThreadMemoryUsages();
+            if (usages.count(threadId) && usages[threadId].nodeCount > 0)
+            {
+                std::cout << "recursion subthread memory: " << usages[threadId] << std::endl;
+                memoryReported = true;
+            }
+        }).join();
+    });
+    t2.join();
+
+    std::thread t3([]() {
+        MMeter::getThreadLocalTreePtr()->setMaxDepth(2);
+        MMeter::getThreadLocalTreePtr()->setSlowCallCount(4);
+        MMETER_SCOPE_PROFILER("nesting subthread");
+        nest(5);
+    });
+    t3.join();
+
+    std::thread t4([]() {
+        MMeter::getThreadLocalTreePtr()->setRecursionFolding(true);
+        MMeter::getThreadLocalTreePtr()->setMaxDepth(3);
+        MMeter::getThreadLocalTreePtr()->setNodeBudget(4);
+        MMETER_SCOPE_PROFILER("folding subthread");
+        nest(5);
+        // parseItem is beyond the budget, so the nested list's items reenter the active "<other>"
+        std::size_t pos = 0;
+        parseList("[1[2]3]", pos);
+    });
+    t4.join();
+
+    std::thread t5([]() {
+        MMeter::getThreadLocalTreePtr()->setNodeBudget(4);
+        MMETER_SCOPE_PROFILER("budget subthread");
+        namedScope("a", false);
+        namedScope("b", false);
+        namedScope("c", false);
+        namedScope("d", true);
+        namedScope("e", true);
+    });
+    t5.join();
+
+#if MMETER_SHARED_MEMORY == 1
+    bool sharedSegmentChecked = false;
+    std::thread t6([&]() { sharedSegmentChecked = checkSharedSegment(); });
+    t6.join();
+    if (!sharedSegmentChecked)
+    {
+        std::cerr << "Wrong shared-memory segment" << std::endl;
+        return 1;
+    }
+#endif
+
     std::cout << std::fixed << std::setprecision(6) << MMeter::getGlobalTreePtr()->totalsByDurationStr() << std::endl;
     std::cout << *MMeter::getGlobalTreePtr() << std::endl;
     MMeter::getGlobalTreePtr()->outputBranchPercentagesToOStream(std::cout);
+
+    if (!memoryReported)
+    {
+        std::cerr << "Missing memory usage of a running thread" << std::endl;
+        return 1;
+    }
+    // The nested calls beyond the max depth are collapsed into the single call of nest
+    if (MMeter::getGlobalTreePtr()->branches().at("nesting subthread").branches().at("nest").slowCalls().size() != 1)
+    {
+        std::cerr << "Collapsed scopes recorded as slow calls" << std::endl;
+        return 1;
+    }
+    // Folded recursion doesn't deepen the tree, so it isn't collapsed
+    const auto &foldingBranch = MMeter::getGlobalTreePtr()->branches().at("folding subthread");
+    if (foldingBranch.branches().at("nest").reentryCount() != 5 ||
+        foldingBranch.branches().at("nest").collapsedCount() != 0 ||
+        foldingBranch.branches().at("parseList").branches().at("<other>").reentryCount() != 1)
+    {
+        std::cerr << "Wrong folding within the max depth and budget" << std::endl;
+        return 1;
+    }
+    // The budget of 4 nodes fits the subthread and 3 scopes, the other 2 go into "<other>" with their nested scopes
+    const auto &budgetBranch = MMeter::getGlobalTreePtr()->branches().at("budget subthread");
+    if (budgetBranch.branches().size() != 3 + 1 || budgetBranch.totals().at("<other>").callCount != 2 ||
+        budgetBranch.branches().at("<other>").collapsedCount() != 2)
+    {
+        std::cerr << "Wrong node budget overflow" << std::endl;
+        return 1;
+    }
+    // "[1[2[3a]b[c[d]]]4]" has 8 digits, parsed 20000 times
+    if (MMeter::getGlobalTreePtr()->totals().at("parseItem").counters.at("digits") != 8 * 20000)
+    {
+        std::cerr << "Wrong digit count" << std::endl;
+        return 1;
+    }
+    // Folding recursion mustn't count any time twice
+    return checkDurations(MMeter::getGlobalTreePtr()->branches().at("recursion subthread")) ? 0 : 1;
 }
\ No newline at end of file
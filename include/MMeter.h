@@ -14,15 +14,23 @@ the measurements just by writing std::cout << MMeter::getGlobalTree();
 #ifndef INCLUDED_MMETER_H
 #define INCLUDED_MMETER_H
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cstdint>
 #include <map>
 #include <ostream>
 #include <set>
 #include <sstream>
 #include <string>
 #include <string_view>
+#include <thread>
 #include <vector>
 
+#if MMETER_SHARED_MEMORY == 1
+#include "MMeterShared.h"
+#endif
+
 #ifndef MMETER_ENABLE
 /**
  * Whether to enable the profiler for this unit
@@ -33,6 +41,104 @@ the measurements just by writing std::cout << MMeter::getGlobalTree();
 #define MMETER_ENABLE 1
 #endif
 
+#ifndef MMETER_FOLD_RECURSION
+/**
+ * Whether thread trees fold recursion into the first occurrence of the branch on the stack by default
+ * 0 = disable
+ * 1 = enable
+ * @note if undefined, it is disabled by default
+ * @note can be changed per tree with FuncProfilerTree::setRecursionFolding
+ */
+#define MMETER_FOLD_RECURSION 0
+#endif
+
+#ifndef MMETER_MAX_DEPTH
+/**
+ * The default max depth of thread trees, beyond which scopes are accumulated into their parent
+ * 0 = unlimited
+ * @note if undefined, the depth is unlimited by default
+ * @note can be changed per tree with FuncProfilerTree::setMaxDepth
+ */
+#define MMETER_MAX_DEPTH 0
+#endif
+
+#ifndef MMETER_NODE_BUDGET
+/**
+ * The default max number of branches in thread trees, beyond which new scopes are accumulated into
+ * an "<other>" branch of their parent
+ * 0 = unlimited
+ * @note if undefined, the node count is unlimited by default
+ * @note can be changed per tree with FuncProfilerTree::setNodeBudget
+ */
+#define MMETER_NODE_BUDGET 0
+#endif
+
+#ifndef MMETER_BYTE_BUDGET
+/**
+ * The default max number of bytes used by the branches of thread trees, beyond which new scopes are accumulated into
+ * an "<other>" branch of their parent
+ * 0 = unlimited
+ * @note if undefined, the memory is unlimited by default
+ * @note can be changed per tree with FuncProfilerTree::setByteBudget
+ */
+#define MMETER_BYTE_BUDGET 0
+#endif
+
+#ifndef MMETER_SLOW_CALL_COUNT
+/**
+ * The default number of slowest calls kept per branch of thread trees
+ * 0 = disable
+ * @note if undefined, slow calls aren't kept by default
+ * @note can be changed per tree with FuncProfilerTree::setSlowCallCount
+ */
+#define MMETER_SLOW_CALL_COUNT 0
+#endif
+
+#ifndef MMETER_INLINE_FAST_PATH
+/**
+ * Whether the scope entry and exit fast path is inlined from the header
+ * 0 = disable
+ * 1 = enable
+ * @note if undefined, it is disabled by default
+ * @note when enabled, the thread tree pointer uses initial-exec TLS where supported,
+ * which can fail to load if MMeter is linked into a dlopen-ed shared library
+ * @warning must be the same for every unit, including MMeter.cpp
+ */
+#define MMETER_INLINE_FAST_PATH 0
+#endif
+
+#ifndef MMETER_SHARED_MEMORY
+/**
+ * Whether each thread publishes its tree to a POSIX shared-memory segment, for viewers like mmeter-top
+ * 0 = disable
+ * 1 = enable
+ * @note if undefined, it is disabled by default
+ * @note the segment layout is described in MMeterShared.h
+ * @warning must be the same for every unit, including MMeter.cpp
+ */
+#define MMETER_SHARED_MEMORY 0
+#endif
+
+#ifndef MMETER_SHARED_MEMORY_SLOTS
+/**
+ * The max number of branches published per thread, further branches aren't published
+ * @note if undefined, it is 1024 by default
+ */
+#define MMETER_SHARED_MEMORY_SLOTS 1024
+#endif
+
+#if MMETER_INLINE_FAST_PATH == 1
+#define MMETER_FAST_PATH_INLINE inline
+#if defined(__GNUC__)
+#define MMETER_TLS_MODEL __attribute__((tls_model("initial-exec")))
+#else
+#define MMETER_TLS_MODEL
+#endif
+#else
+#define MMETER_FAST_PATH_INLINE
+#define MMETER_TLS_MODEL
+#endif
+
 /**
  * @brief The name of the function being measured
  */
@@ -58,10 +164,25 @@ the measurements just by writing std::cout << MMeter::getGlobalTree();
 #define MMETER_SCOPE_PROFILER(name)                                                                                    \
     MMeter::FuncProfiler _MMeterProfilerObject(std::chrono::system_clock::now(), name, MMeter::getThreadLocalTreePtr())
 
+/**
+ * @brief A macro for counting units of work done in the currently measured scope
+ * @param name the name of the counter, e.g. "bytes"
+ * @param value the value to add to the counter
+ */
+#define MMETER_COUNT(name, value) MMeter::getThreadLocalTreePtr()->stackCount(name, value)
+
+/**
+ * @brief A macro for tagging the slow calls recorded by this thread from now on
+ * @param tag the tag, e.g. a request id
+ */
+#define MMETER_SLOW_CALL_TAG(tag) MMeter::getThreadLocalTreePtr()->setSlowCallTag(tag)
+
 #else
 
 #define MMETER_FUNC_PROFILER
 #define MMETER_SCOPE_PROFILER(name)
+#define MMETER_COUNT(name, value)
+#define MMETER_SLOW_CALL_TAG(tag)
 
 #endif
 
@@ -76,6 +197,11 @@ using Duration = std::chrono::duration<double>;
 
 class FuncProfilerTree;
 
+namespace Shared
+{
+struct Header;
+}
+
 /**
  * @brief a struct containing the results of a measurement
  */
@@ -95,6 +221,7 @@ struct Results
     StringView branchName;
     Duration realDuration;
     std::size_t callCount;
+    std::map<StringView, double> counters;
 
     inline bool operator==(const Results &other) const
     {
@@ -122,6 +249,34 @@ struct Results
     }
 };
 
+/**
+ * @brief a struct describing a single slow call of a branch
+ */
+struct SlowCall
+{
+    Time startTime;
+    std::thread::id threadId;
+    Duration duration;
+    String tag;
+};
+
+/**
+ * @brief a struct containing the memory used by MMeter
+ */
+struct MemoryUsage
+{
+    std::size_t nodeCount;
+    std::size_t byteCount;
+};
+
+/**
+ * @brief prints a MemoryUsage to the output stream
+ * @param out the output stream
+ * @param usage the memory usage to print
+ * @returns the output stream
+ */
+std::ostream &operator<<(std::ostream &out, const MemoryUsage &usage);
+
 /**
  * @brief prints a FuncProfilerTree to the output stream
  * @param out the output stream
@@ -143,10 +298,72 @@ template <class _OS_T> _OS_T &operator<<(_OS_T &out, FuncProfilerTree &tree)
     return static_cast<_OS_T &>(static_cast<std::ostream &>(out) << tree);
 }
 
+namespace Detail
+{
+/**
+ * @brief this thread's FuncProfilerTree, set by initThreadLocalTreePtr()
+ */
+inline thread_local FuncProfilerTree *threadLocalTreePtr MMETER_TLS_MODEL = nullptr;
+
+/**
+ * @brief sets up this thread's FuncProfilerTree
+ * @returns a pointer to this thread's FuncProfilerTree
+ */
+FuncProfilerTree *initThreadLocalTreePtr();
+
+/**
+ * @brief shared-memory slot index of branches without a slot, equal to Shared::NoSlot
+ */
+constexpr std::uint32_t NoSharedSlot = UINT32_MAX;
+
+/**
+ * @brief a counter written by a single thread and readable by any thread
+ */
+class RelaxedCounter
+{
+  public:
+    inline RelaxedCounter(std::size_t value = 0) : mValue(value)
+    {
+    }
+    inline RelaxedCounter(const RelaxedCounter &other) : mValue(other.load())
+    {
+    }
+    inline RelaxedCounter &operator=(const RelaxedCounter &other)
+    {
+        mValue.store(other.load(), std::memory_order_relaxed);
+        return *this;
+    }
+
+    inline std::size_t load() const
+    {
+        return mValue.load(std::memory_order_relaxed);
+    }
+    inline operator std::size_t() const
+    {
+        return load();
+    }
+
+    // Only the owning thread writes, so no read-modify-write is needed
+    inline RelaxedCounter &operator+=(std::size_t value)
+    {
+        mValue.store(load() + value, std::memory_order_relaxed);
+        return *this;
+    }
+    inline RelaxedCounter &operator-=(std::size_t value)
+    {
+        mValue.store(load() - value, std::memory_order_relaxed);
+        return *this;
+    }
+
+  private:
+    std::atomic<std::size_t> mValue;
+};
+} // namespace Detail
+
 /**
  * @returns a pointer to this thread's FuncProfilerTree
  */
-FuncProfilerTree *getThreadLocalTreePtr();
+MMETER_FAST_PATH_INLINE FuncProfilerTree *getThreadLocalTreePtr();
 
 /**
  * @brief a thread-safe pointer to the global FuncProfilerTree
@@ -167,6 +384,12 @@ class GlobalFuncProfilerTreePtr
  */
 GlobalFuncProfilerTreePtr getGlobalTreePtr();
 
+/**
+ * @returns the memory counted against the budgets by the FuncProfilerTree of each running thread
+ * @note exited threads are merged into the global tree, see FuncProfilerTree::memoryUsage
+ */
+std::map<std::thread::id, MemoryUsage> getThreadMemoryUsages();
+
 /**
  * @brief A branch of scope tree execution timing measurements
  */
@@ -182,7 +405,7 @@ class FuncProfilerTree
     /**
      * @returns All the branches by their names
      */
-    inline const std::map<String, FuncProfilerTree> &branches() const
+    inline const std::map<String, FuncProfilerTree, std::less<>> &branches() const
     {
         return mBranches;
     }
@@ -237,6 +460,57 @@ class FuncProfilerTree
         return realDuration() - subTotal;
     }
 
+    /**
+     * @returns number of recursive calls folded into this branch
+     */
+    inline std::size_t reentryCount() const
+    {
+        return mReentryCount;
+    }
+
+    /**
+     * @returns max number of simultaneous activations of this branch, counting folded recursion
+     */
+    inline std::size_t maxRecursionDepth() const
+    {
+        return mMaxRecursionDepth;
+    }
+
+    /**
+     * @returns number of scopes beyond the max depth that were accumulated into this branch
+     */
+    inline std::size_t collapsedCount() const
+    {
+        return mCollapsedCount;
+    }
+
+    /**
+     * @returns the custom counters of this branch by their names
+     */
+    inline const std::map<String, double, std::less<>> &counters() const
+    {
+        return mCounters;
+    }
+
+    /**
+     * @returns the slowest calls of this branch, slowest first
+     */
+    std::vector<SlowCall> slowCalls() const;
+
+    /**
+     * @returns estimated memory used by the tree and its subbranches
+     */
+    MemoryUsage memoryUsage() const;
+
+    /**
+     * @returns the memory counted against the node and byte budgets
+     * @note unlike memoryUsage, it can be called from any thread while the tree is in use
+     */
+    inline MemoryUsage budgetUsage() const
+    {
+        return {mNodeCount.load(), mByteCount.load()};
+    }
+
     /**
      * @returns map of branch names to their results, summing all references and reentries
      */
@@ -254,16 +528,18 @@ class FuncProfilerTree
 
     /**
      * @returns string representation of the tree totals
+     * @note slow calls belong to single branches, so they're only output with the tree of branches
      */
     String totalsStr(size_t indent = 0, size_t indentSpaces = 4) const;
 
     /**
      * @returns string representation of the tree totals, ordered by duration
+     * @note slow calls belong to single branches, so they're only output with the tree of branches
      */
     String totalsByDurationStr(size_t indent = 0, size_t indentSpaces = 4) const;
 
     /**
-     * @brief Outputs structured tree of branches to a stream, ordered by duration
+     * @brief Outputs structured tree of branches to a stream, ordered by duration, with their slowest calls
      * @param out Output stream
      * @param indent Indentation level
      * @param indentSpaces Number of spaces per indentation
@@ -271,13 +547,122 @@ class FuncProfilerTree
     void outputBranchDurationsToOStream(std::ostream &out, size_t indent = 0, size_t indentSpaces = 4) const;
 
     /**
-     * @brief Outputs structured tree of branches to a stream, ordered by duration. Duration expressed relatively.
+     * @brief Outputs structured tree of branches to a stream, ordered by duration, with their slowest calls.
+     * Duration expressed relatively.
      * @param out Output stream
      * @param indent Indentation level
      * @param indentSpaces Number of spaces per indentation
      */
     void outputBranchPercentagesToOStream(std::ostream &out, size_t indent = 0, size_t indentSpaces = 4) const;
 
+    /*
+    Configuration
+    */
+
+    /**
+     * @brief Sets whether direct and indirect recursion is folded into the first occurrence of the branch on the
+     * stack, instead of creating a new nested branch per recursion level
+     * @note while a branch is reentered, branches entered after its first occurrence don't measure time,
+     * unless they're reentered too
+     * @warning only change while the stack is empty
+     */
+    inline void setRecursionFolding(bool fold)
+    {
+        mFoldRecursion = fold;
+    }
+
+    /**
+     * @returns whether recursion is folded
+     */
+    inline bool recursionFolding() const
+    {
+        return mFoldRecursion;
+    }
+
+    /**
+     * @brief Sets the max depth of the tree, beyond which scopes are accumulated into their parent
+     * @param depth the max depth, 0 for unlimited
+     * @note folded recursion doesn't deepen the tree, so it's never accumulated
+     */
+    inline void setMaxDepth(std::size_t depth)
+    {
+        mMaxDepth = depth;
+    }
+
+    /**
+     * @returns the max depth of the tree, 0 if unlimited
+     */
+    inline std::size_t maxDepth() const
+    {
+        return mMaxDepth;
+    }
+
+    /**
+     * @brief Sets the max number of branches created by stackPush,
+     * beyond which new scopes are accumulated into an "<other>" branch of their parent
+     * @param nodeCount the max number of branches, 0 for unlimited
+     */
+    inline void setNodeBudget(std::size_t nodeCount)
+    {
+        mNodeBudget = nodeCount;
+    }
+
+    /**
+     * @returns the max number of branches created by stackPush, 0 if unlimited
+     */
+    inline std::size_t nodeBudget() const
+    {
+        return mNodeBudget;
+    }
+
+    /**
+     * @brief Sets the max number of bytes used by branches created by stackPush,
+     * beyond which new scopes are accumulated into an "<other>" branch of their parent
+     * @param byteCount the max number of bytes, 0 for unlimited
+     */
+    inline void setByteBudget(std::size_t byteCount)
+    {
+        mByteBudget = byteCount;
+    }
+
+    /**
+     * @returns the max number of bytes used by branches created by stackPush, 0 if unlimited
+     */
+    inline std::size_t byteBudget() const
+    {
+        return mByteBudget;
+    }
+
+    /**
+     * @brief Sets the number of slowest calls kept per branch
+     * @param callCount the number of calls, 0 to disable
+     */
+    void setSlowCallCount(std::size_t callCount);
+
+    /**
+     * @returns the number of slowest calls kept per branch, 0 if disabled
+     */
+    inline std::size_t slowCallCount() const
+    {
+        return mSlowCallCount;
+    }
+
+    /**
+     * @brief Sets the tag attached to slow calls recorded from now on
+     */
+    inline void setSlowCallTag(const String &tag)
+    {
+        mSlowCallTag = tag;
+    }
+
+    /**
+     * @returns the tag attached to newly recorded slow calls
+     */
+    inline const String &slowCallTag() const
+    {
+        return mSlowCallTag;
+    }
+
     /*
     Tree manipulation
     */
@@ -294,13 +679,22 @@ class FuncProfilerTree
 
     /**
      * @brief simulates a stack frame push
+     * @note with recursion folding enabled, a branch already on the stack is reentered instead of nested
+     * @note beyond the max depth, the parent branch is reentered instead
+     * @note beyond the node or byte budget, new branches are replaced by the parent's "<other>" branch
      */
-    FuncProfilerTree &stackPush(const String &branchName);
+    MMETER_FAST_PATH_INLINE FuncProfilerTree &stackPush(StringView branchName);
 
     /**
      * @brief simulates a stack frame pop
      */
-    void stackPop();
+    MMETER_FAST_PATH_INLINE void stackPop();
+
+    /**
+     * @brief adds a value to a custom counter of the branch on top of the stack
+     * @note new counters beyond the node or byte budget are accumulated into an "<other>" counter
+     */
+    void stackCount(StringView counterName, double value);
 
     /**
      * @returns the stack of currently called branch pointers
@@ -310,6 +704,21 @@ class FuncProfilerTree
         return mBranchPtrStack;
     }
 
+    /**
+     * @brief Publishes the branches created from now on to a shared-memory segment
+     * @param headerPtr the initialized segment, or nullptr to stop publishing
+     * @note done automatically for thread trees when MMETER_SHARED_MEMORY is enabled
+     */
+    void setSharedSegment(Shared::Header *headerPtr);
+
+    /**
+     * @returns the shared-memory segment the tree publishes to, or nullptr
+     */
+    inline const Shared::Header *sharedSegment() const
+    {
+        return mSharedHeaderPtr;
+    }
+
     /**
      * @brief resets the tree to its initial state, before tracking anything
      */
@@ -321,10 +730,78 @@ class FuncProfilerTree
     void merge(const FuncProfilerTree &tree);
 
   private:
-    std::map<String, FuncProfilerTree> mBranches;
+    /**
+     * @brief bookkeeping of a pushed stack frame
+     */
+    struct ActiveName;
+
+    struct FrameInfo
+    {
+        const String *branchName;
+        FuncProfilerTree *choreBranchPtr;
+        ActiveName *activeNamePtr;
+        bool collapsed;
+    };
+
+    /**
+     * @brief a branch on the stack while folding recursion.
+     * Only the branch on top of the stack and its parents are measuring, i.e. are on the path
+     */
+    struct ActiveName
+    {
+        std::size_t frameIndex;
+        std::size_t refCount;
+        ActiveName *parentPtr;
+        std::size_t depth;
+        bool onPath;
+        Time leaveTime;
+    };
+
+    FuncProfilerTree &stackPushSlow(StringView branchName);
+    FuncProfilerTree &stackPushParent();
+    ActiveName *findActiveName(StringView branchName);
+    FuncProfilerTree &reenterBranch(ActiveName &activeName);
+    std::size_t stackTreeDepth() const;
+    bool overBudget() const;
+    void stackPopFolded();
+    void movePath(ActiveName *fromPtr, ActiveName *toPtr);
+    std::map<String, FuncProfilerTree, std::less<>>::iterator newBranch(FuncProfilerTree &parent,
+                                                                        StringView branchName);
+
+    inline FuncProfilerTree &enterBranch(std::pair<const String, FuncProfilerTree> &nameBranchPair)
+    {
+        auto branchPtr = &nameBranchPair.second;
+        branchPtr->mCount++;
+        branchPtr->mActiveCount++;
+        branchPtr->mMaxRecursionDepth = std::max(branchPtr->mMaxRecursionDepth, branchPtr->mActiveCount);
+        mBranchPtrStack.push_back(branchPtr);
+        mFrameStack.push_back({&nameBranchPair.first, branchPtr, nullptr, false});
+        return *branchPtr;
+    }
+    MemoryUsage branchesMemoryUsage() const;
+    static std::size_t branchByteSize(const String &branchName, const FuncProfilerTree &branch);
+    void recordSlowCall(FuncProfilerTree &branch, Time startTime, Time::duration duration);
+    void assignSharedSlot(FuncProfilerTree &parent, const String &branchName, FuncProfilerTree &branch);
+    void publishBranch(const FuncProfilerTree &branch);
+
+    std::map<String, FuncProfilerTree, std::less<>> mBranches;
+    std::map<String, double, std::less<>> mCounters;
+    std::vector<SlowCall> mSlowCallHeap;
+    std::size_t mSlowCallCapacity;
+    Time::duration mSlowCallThreshold;
     std::vector<FuncProfilerTree *> mBranchPtrStack;
+    std::vector<FrameInfo> mFrameStack;
+    std::map<StringView, ActiveName, std::less<>> mActiveNames;
     Duration mDuration, mChoreDuration;
-    std::size_t mCount;
+    std::size_t mCount, mReentryCount, mMaxRecursionDepth, mCollapsedCount, mActiveCount;
+    bool mFoldRecursion;
+    std::size_t mMaxDepth;
+    std::size_t mNodeBudget, mByteBudget;
+    Detail::RelaxedCounter mNodeCount, mByteCount;
+    std::size_t mSlowCallCount;
+    String mSlowCallTag;
+    Shared::Header *mSharedHeaderPtr;
+    std::uint32_t mSharedSlot;
 };
 
 /**
@@ -333,8 +810,8 @@ class FuncProfilerTree
 class FuncProfiler
 {
   public:
-    FuncProfiler(Time startTime, CString name, FuncProfilerTree *treePtr);
-    ~FuncProfiler();
+    MMETER_FAST_PATH_INLINE FuncProfiler(Time startTime, CString name, FuncProfilerTree *treePtr);
+    MMETER_FAST_PATH_INLINE ~FuncProfiler();
 
   private:
     Time mStartTime;
@@ -342,6 +819,87 @@ class FuncProfiler
     FuncProfilerTree *mTreePtr, *mBranchPtr;
 };
 
+/*
+Fast path, inlined here or defined in MMeter.cpp depending on MMETER_INLINE_FAST_PATH
+*/
+
+#if MMETER_INLINE_FAST_PATH == 1 || defined(MMETER_DEFINE_FAST_PATH)
+
+MMETER_FAST_PATH_INLINE FuncProfilerTree *getThreadLocalTreePtr()
+{
+    auto treePtr = Detail::threadLocalTreePtr;
+    if (treePtr == nullptr)
+    {
+        treePtr = Detail::initThreadLocalTreePtr();
+    }
+    return treePtr;
+}
+
+MMETER_FAST_PATH_INLINE FuncProfilerTree &FuncProfilerTree::stackPush(StringView branchName)
+{
+    // Only plain reentry of an existing branch is handled here
+    if (!mFoldRecursion && (mMaxDepth == 0 || mBranchPtrStack.size() <= mMaxDepth))
+    {
+        auto &branches = mBranchPtrStack.back()->mBranches;
+        auto branchIt = branches.find(branchName);
+        if (branchIt != branches.end())
+        {
+            return enterBranch(*branchIt);
+        }
+    }
+    return stackPushSlow(branchName);
+}
+
+MMETER_FAST_PATH_INLINE void FuncProfilerTree::stackPop()
+{
+    if (mFrameStack.back().activeNamePtr != nullptr)
+    {
+        stackPopFolded();
+    }
+    mBranchPtrStack.back()->mActiveCount--;
+    mBranchPtrStack.pop_back();
+    mFrameStack.pop_back();
+}
+
+MMETER_FAST_PATH_INLINE FuncProfiler::FuncProfiler(Time startTime, CString name, FuncProfilerTree *treePtr)
+    : mTreePtr(treePtr)
+{
+    mStartTime = startTime;
+
+    mBranchPtr = &treePtr->stackPush(name);
+    mChoresDuration = std::chrono::system_clock::now() - mStartTime;
+}
+
+MMETER_FAST_PATH_INLINE FuncProfiler::~FuncProfiler()
+{
+    auto endTime = std::chrono::system_clock::now();
+    auto duration = endTime - mStartTime;
+    // Reentries are already measured by the outermost activation of the branch
+    if (mBranchPtr->mActiveCount == 1)
+    {
+        mBranchPtr->mDuration += duration;
+    }
+    auto &frame = mTreePtr->mFrameStack.back();
+    // The threshold is the fastest kept slow call, or zero while there's space for more.
+    // Collapsed scopes are part of their parent's call, not calls of their own
+    if (duration > mBranchPtr->mSlowCallThreshold && !frame.collapsed)
+    {
+        mTreePtr->recordSlowCall(*mBranchPtr, mStartTime, duration);
+    }
+    auto choreBranchPtr = frame.choreBranchPtr;
+    mTreePtr->stackPop();
+    mChoresDuration += std::chrono::system_clock::now() - endTime;
+    choreBranchPtr->mChoreDuration += mChoresDuration;
+#if MMETER_SHARED_MEMORY == 1
+    if (mBranchPtr->mSharedSlot != Detail::NoSharedSlot)
+    {
+        mTreePtr->publishBranch(*mBranchPtr);
+    }
+#endif
+}
+
+#endif
+
 } // namespace MMeter
 
 #endif // INCLUDED_MMETER_H
\ No newline at end of file
@@ -0,0 +1,124 @@
+/*
+Made by Mauricio Smit
+repository: https://github.com/LegendaryMauricius/MMeter
+
+Layout of the POSIX shared-memory segments used for the live view of a running process.
+Each thread that uses MMeter with MMETER_SHARED_MEMORY enabled owns the segment named
+MMeter::Shared::segmentName(pid, threadIndex), and is its only writer.
+Slots are updated with a seqlock: the sequence is odd while a slot is being written.
+This file is shared by the profiler and external viewers such as tools/mmeter-top.cpp,
+so it doesn't depend on the rest of MMeter.
+*/
+
+#pragma once
+#ifndef INCLUDED_MMETER_SHARED_H
+#define INCLUDED_MMETER_SHARED_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace MMeter
+{
+namespace Shared
+{
+
+/**
+ * @brief Identifies an MMeter segment, "MMTR"
+ */
+constexpr std::uint32_t Magic = 0x4D4D5452;
+
+/**
+ * @brief Version of the layout, increased on every incompatible change
+ */
+constexpr std::uint32_t Version = 1;
+
+/**
+ * @brief Max length of a branch name, including the terminating zero. Longer names are truncated
+ */
+constexpr std::size_t NameCapacity = 64;
+
+/**
+ * @brief Slot index of branches without a slot, and parent index of top-level branches
+ */
+constexpr std::uint32_t NoSlot = UINT32_MAX;
+
+/**
+ * @brief A published branch
+ */
+struct Slot
+{
+    std::atomic<std::uint32_t> sequence;
+    std::uint32_t parentIndex;
+    char name[NameCapacity];
+    std::atomic<std::uint64_t> callCount;
+    std::atomic<std::uint64_t> durationNs;
+    std::atomic<std::uint64_t> choreDurationNs;
+};
+
+/**
+ * @brief The start of a segment, followed by slotCapacity slots
+ */
+struct Header
+{
+    std::uint32_t magic;
+    std::uint32_t version;
+    std::uint32_t headerSize;
+    std::uint32_t slotSize;
+    std::uint64_t pid;
+    std::uint64_t threadIndex;
+    std::uint32_t slotCapacity;
+    std::atomic<std::uint32_t> slotCount;
+    std::uint8_t reserved[24];
+};
+
+static_assert(std::atomic<std::uint32_t>::is_always_lock_free && std::atomic<std::uint64_t>::is_always_lock_free,
+              "shared-memory counters must be lock-free");
+static_assert(sizeof(Slot) == 96, "the slot layout must stay stable");
+static_assert(sizeof(Header) == 64, "the header layout must stay stable");
+
+/**
+ * @returns the name of the segment of a thread
+ */
+inline std::string segmentName(std::uint64_t pid, std::uint64_t threadIndex)
+{
+    return "/mmeter." + std::to_string(pid) + "." + std::to_string(threadIndex);
+}
+
+/**
+ * @returns the prefix of the segment names of a process, without the leading slash
+ */
+inline std::string segmentPrefix(std::uint64_t pid)
+{
+    return "mmeter." + std::to_string(pid) + ".";
+}
+
+/**
+ * @returns the size of a segment in bytes
+ */
+inline std::size_t segmentSize(std::uint32_t slotCapacity)
+{
+    return sizeof(Header) + slotCapacity * sizeof(Slot);
+}
+
+/**
+ * @returns the slots following the header
+ */
+inline Slot *slots(Header *header)
+{
+    return reinterpret_cast<Slot *>(header + 1);
+}
+
+/**
+ * @returns the slots following the header
+ */
+inline const Slot *slots(const Header *header)
+{
+    return reinterpret_cast<const Slot *>(header + 1);
+}
+
+} // namespace Shared
+} // namespace MMeter
+
+#endif // INCLUDED_MMETER_SHARED_H
@@ -10,16 +10,125 @@ You can output the tree directly to any output stream, so you can retrieve
 the measurements just by writing std::cout << MMeter::getGlobalTree();
 */
 
+#define MMETER_DEFINE_FAST_PATH
 #include "MMeter.h"
 
+#include <algorithm>
+#include <atomic>
 #include <mutex>
+#include <tuple>
+
+#if MMETER_SHARED_MEMORY == 1
+#include "MMeterShared.h"
+
+#include <new>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+static_assert(MMeter::Detail::NoSharedSlot == MMeter::Shared::NoSlot, "the no-slot sentinels must match");
+#endif
 
 using namespace std::chrono_literals;
 using std::chrono::duration_cast;
 
 namespace MMeter
 {
-FuncProfilerTree::FuncProfilerTree() : mDuration(0), mChoreDuration(0), mCount(0)
+namespace
+{
+
+const String OverflowBranchName = "<other>";
+
+// Estimated bookkeeping of a std::map node, i.e. its color and links
+constexpr std::size_t MapNodeOverhead = 4 * sizeof(void *);
+
+std::size_t stringHeapSize(const String &str)
+{
+    return str.capacity() > String().capacity() ? str.capacity() + 1 : 0;
+}
+
+std::size_t counterByteSize(const String &counterName)
+{
+    return MapNodeOverhead + sizeof(std::pair<const String, double>) + stringHeapSize(counterName);
+}
+
+template <class _MAP_T> void outputCounters(std::ostream &out, const _MAP_T &counters, Duration realDuration)
+{
+    for (auto &nameValuePair : counters)
+    {
+        out << " {" << nameValuePair.first << ": " << nameValuePair.second;
+        if (realDuration.count() > 0 && nameValuePair.second != 0)
+        {
+            out << " @" << (nameValuePair.second / realDuration.count()) << "/s, "
+                << (realDuration.count() * 1e9 / nameValuePair.second) << "ns each";
+        }
+        out << "}";
+    }
+}
+
+bool isSlowerCall(const SlowCall &a, const SlowCall &b)
+{
+    return a.duration > b.duration;
+}
+
+std::size_t slowCallsByteSize(const std::vector<SlowCall> &slowCalls)
+{
+    std::size_t size = slowCalls.capacity() * sizeof(SlowCall);
+    for (auto &slowCall : slowCalls)
+    {
+        size += stringHeapSize(slowCall.tag);
+    }
+    return size;
+}
+
+void outputBranchNotes(std::ostream &out, const FuncProfilerTree &branch)
+{
+    if (branch.reentryCount() > 0)
+    {
+        out << " [reentries: " << branch.reentryCount() << ", max depth: " << branch.maxRecursionDepth() << "]";
+    }
+    if (branch.collapsedCount() > 0)
+    {
+        out << " [collapsed: " << branch.collapsedCount() << "]";
+    }
+}
+
+void outputSlowCalls(std::ostream &out, const FuncProfilerTree &branch, size_t indent, size_t indentSpaces)
+{
+    for (auto &slowCall : branch.slowCalls())
+    {
+        for (size_t i = 0; i < indent; i++)
+        {
+            out << '|';
+            for (size_t j = 0; j < indentSpaces; j++)
+            {
+                out << ' ';
+            }
+        }
+
+        // Whole microseconds since the epoch, regardless of the stream's float format
+        auto startMicroseconds =
+            duration_cast<std::chrono::microseconds>(slowCall.startTime.time_since_epoch()).count();
+        out << '!' << slowCall.duration.count() << "s @" << std::to_string(startMicroseconds) << "us on thread "
+            << slowCall.threadId;
+        if (!slowCall.tag.empty())
+        {
+            out << " - " << slowCall.tag;
+        }
+        out << std::endl;
+    }
+}
+
+} // namespace
+
+FuncProfilerTree::FuncProfilerTree()
+    : mSlowCallCapacity(0), mSlowCallThreshold(0), mDuration(0), mChoreDuration(0), mCount(0), mReentryCount(0),
+      mMaxRecursionDepth(0), mCollapsedCount(0), mActiveCount(0), mFoldRecursion(MMETER_FOLD_RECURSION == 1),
+      mMaxDepth(MMETER_MAX_DEPTH), mNodeBudget(MMETER_NODE_BUDGET), mByteBudget(MMETER_BYTE_BUDGET), mNodeCount(0),
+      mByteCount(0), mSlowCallCount(MMETER_SLOW_CALL_COUNT), mSharedHeaderPtr(nullptr),
+      mSharedSlot(Detail::NoSharedSlot)
 {
     mBranchPtrStack.push_back(this);
 }
@@ -29,15 +138,339 @@ FuncProfilerTree &FuncProfilerTree::existingOrNewBranch(const String &branchName
     return mBranches[branchName];
 }
 
-FuncProfilerTree &FuncProfilerTree::stackPush(const String &branchName)
+FuncProfilerTree &FuncProfilerTree::stackPushSlow(StringView branchName)
 {
-    mBranchPtrStack.push_back(&(*mBranchPtrStack.back()).existingOrNewBranch(branchName));
-    return *mBranchPtrStack.back();
+    auto parentPtr = mBranchPtrStack.back();
+
+    // Reenter the first occurrence of the branch on the stack
+    if (auto activeNamePtr = findActiveName(branchName))
+    {
+        return reenterBranch(*activeNamePtr);
+    }
+
+    // Too deep, accumulate into the parent
+    if (mMaxDepth > 0 && stackTreeDepth() >= mMaxDepth)
+    {
+        return stackPushParent();
+    }
+
+    auto branchIt = parentPtr->mBranches.find(branchName);
+    if (branchIt == parentPtr->mBranches.end())
+    {
+        if (overBudget())
+        {
+            // Out of budget, accumulate into the overflow branch
+            if (!mFrameStack.empty() && *mFrameStack.back().branchName == OverflowBranchName)
+            {
+                return stackPushParent();
+            }
+            // The overflow branch of another parent may still be active
+            if (auto activeNamePtr = findActiveName(OverflowBranchName))
+            {
+                return reenterBranch(*activeNamePtr);
+            }
+            branchIt = newBranch(*parentPtr, OverflowBranchName);
+        }
+        else
+        {
+            branchIt = newBranch(*parentPtr, branchName);
+        }
+    }
+
+    auto &branch = enterBranch(*branchIt);
+
+    if (mFoldRecursion)
+    {
+        auto parentNamePtr = mFrameStack.size() > 1 ? mFrameStack[mFrameStack.size() - 2].activeNamePtr : nullptr;
+        auto &frame = mFrameStack.back();
+        auto &activeName = mActiveNames.try_emplace(*frame.branchName).first->second;
+        activeName.frameIndex = mFrameStack.size() - 1;
+        activeName.refCount = 1;
+        activeName.parentPtr = parentNamePtr;
+        activeName.depth = parentNamePtr ? parentNamePtr->depth + 1 : 0;
+        activeName.onPath = true;
+        frame.activeNamePtr = &activeName;
+    }
+
+    return branch;
+}
+
+FuncProfilerTree::ActiveName *FuncProfilerTree::findActiveName(StringView branchName)
+{
+    if (!mFoldRecursion)
+    {
+        return nullptr;
+    }
+    auto activeNameIt = mActiveNames.find(branchName);
+    if (activeNameIt == mActiveNames.end() || activeNameIt->second.refCount == 0)
+    {
+        return nullptr;
+    }
+    return &activeNameIt->second;
+}
+
+FuncProfilerTree &FuncProfilerTree::reenterBranch(ActiveName &activeName)
+{
+    auto branchPtr = mBranchPtrStack[activeName.frameIndex + 1];
+    branchPtr->mCount++;
+    branchPtr->mReentryCount++;
+    branchPtr->mActiveCount++;
+    branchPtr->mMaxRecursionDepth = std::max(branchPtr->mMaxRecursionDepth, branchPtr->mActiveCount);
+    activeName.refCount++;
+
+    movePath(mFrameStack.back().activeNamePtr, &activeName);
+
+    mBranchPtrStack.push_back(branchPtr);
+    mFrameStack.push_back({mFrameStack[activeName.frameIndex].branchName, branchPtr, &activeName, false});
+    return *branchPtr;
+}
+
+std::size_t FuncProfilerTree::stackTreeDepth() const
+{
+    // Reentries and collapsed scopes don't add nodes, so while folding the tree can be shallower than the stack.
+    // Without folding, collapsed scopes only lie beyond the max depth or in the overflow branch, which collapses anyway
+    if (mFoldRecursion && !mFrameStack.empty() && mFrameStack.back().activeNamePtr != nullptr)
+    {
+        return mFrameStack.back().activeNamePtr->depth + 1;
+    }
+    return mFrameStack.size();
+}
+
+FuncProfilerTree &FuncProfilerTree::stackPushParent()
+{
+    auto parentPtr = mBranchPtrStack.back();
+    parentPtr->mCollapsedCount++;
+    parentPtr->mActiveCount++;
+    mBranchPtrStack.push_back(parentPtr);
+    mFrameStack.push_back(
+        {mFrameStack.back().branchName, mFrameStack.back().choreBranchPtr, mFrameStack.back().activeNamePtr, true});
+    return *parentPtr;
+}
+
+bool FuncProfilerTree::overBudget() const
+{
+    return (mNodeBudget > 0 && mNodeCount >= mNodeBudget) || (mByteBudget > 0 && mByteCount >= mByteBudget);
+}
+
+void FuncProfilerTree::stackPopFolded()
+{
+    auto &frame = mFrameStack.back();
+    if (frame.collapsed)
+    {
+        return;
+    }
+
+    auto activeNamePtr = frame.activeNamePtr;
+    activeNamePtr->refCount--;
+
+    if (activeNamePtr->refCount == 0)
+    {
+        activeNamePtr->onPath = false;
+    }
+    else
+    {
+        movePath(activeNamePtr, mFrameStack[mFrameStack.size() - 2].activeNamePtr);
+    }
+}
+
+void FuncProfilerTree::movePath(ActiveName *fromPtr, ActiveName *toPtr)
+{
+    if (fromPtr == toPtr)
+    {
+        return;
+    }
+
+    // Walk up from both branches to their common parent, the branches in between leave or enter the path
+    auto now = std::chrono::system_clock::now();
+    while (fromPtr != toPtr)
+    {
+        if (toPtr == nullptr || (fromPtr != nullptr && fromPtr->depth >= toPtr->depth))
+        {
+            fromPtr->onPath = false;
+            fromPtr->leaveTime = now;
+            fromPtr = fromPtr->parentPtr;
+        }
+        else
+        {
+            if (!toPtr->onPath)
+            {
+                toPtr->onPath = true;
+                mBranchPtrStack[toPtr->frameIndex + 1]->mDuration -= now - toPtr->leaveTime;
+            }
+            toPtr = toPtr->parentPtr;
+        }
+    }
 }
 
-void FuncProfilerTree::stackPop()
+std::map<String, FuncProfilerTree, std::less<>>::iterator FuncProfilerTree::newBranch(FuncProfilerTree &parent,
+                                                                                      StringView branchName)
 {
-    mBranchPtrStack.pop_back();
+    auto [branchIt, inserted] = parent.mBranches.try_emplace(String(branchName));
+    if (inserted)
+    {
+        mNodeCount += 1;
+        mByteCount += branchByteSize(branchIt->first, branchIt->second);
+#if MMETER_SHARED_MEMORY == 1
+        if (mSharedHeaderPtr != nullptr)
+        {
+            assignSharedSlot(parent, branchIt->first, branchIt->second);
+        }
+#endif
+    }
+    return branchIt;
+}
+
+void FuncProfilerTree::setSharedSegment(Shared::Header *headerPtr)
+{
+    mSharedHeaderPtr = headerPtr;
+
+    // Existing branches don't belong to the new segment
+    std::vector<FuncProfilerTree *> branchPtrs = {this};
+    while (!branchPtrs.empty())
+    {
+        auto branchPtr = branchPtrs.back();
+        branchPtrs.pop_back();
+        branchPtr->mSharedSlot = Detail::NoSharedSlot;
+        for (auto &nameBranchPair : branchPtr->mBranches)
+        {
+            branchPtrs.push_back(&nameBranchPair.second);
+        }
+    }
+}
+
+#if MMETER_SHARED_MEMORY == 1
+void FuncProfilerTree::assignSharedSlot(FuncProfilerTree &parent, const String &branchName, FuncProfilerTree &branch)
+{
+    auto slotIndex = mSharedHeaderPtr->slotCount.load(std::memory_order_relaxed);
+
+    // Children of unpublished branches would be shown in the wrong place
+    if (slotIndex >= mSharedHeaderPtr->slotCapacity || (&parent != this && parent.mSharedSlot == Shared::NoSlot))
+    {
+        return;
+    }
+
+    auto &slot = Shared::slots(mSharedHeaderPtr)[slotIndex];
+    auto sequence = slot.sequence.load(std::memory_order_relaxed);
+    slot.sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    slot.parentIndex = (&parent == this) ? Shared::NoSlot : parent.mSharedSlot;
+    auto nameLength = branchName.copy(slot.name, Shared::NameCapacity - 1);
+    slot.name[nameLength] = '\0';
+    slot.callCount.store(0, std::memory_order_relaxed);
+    slot.durationNs.store(0, std::memory_order_relaxed);
+    slot.choreDurationNs.store(0, std::memory_order_relaxed);
+
+    slot.sequence.store(sequence + 2, std::memory_order_release);
+    mSharedHeaderPtr->slotCount.store(slotIndex + 1, std::memory_order_release);
+    branch.mSharedSlot = slotIndex;
+}
+
+void FuncProfilerTree::publishBranch(const FuncProfilerTree &branch)
+{
+    auto &slot = Shared::slots(mSharedHeaderPtr)[branch.mSharedSlot];
+    auto sequence = slot.sequence.load(std::memory_order_relaxed);
+    slot.sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    slot.callCount.store(branch.mCount, std::memory_order_relaxed);
+    slot.durationNs.store(duration_cast<std::chrono::nanoseconds>(branch.mDuration).count(),
+                          std::memory_order_relaxed);
+    slot.choreDurationNs.store(duration_cast<std::chrono::nanoseconds>(branch.mChoreDuration).count(),
+                               std::memory_order_relaxed);
+
+    slot.sequence.store(sequence + 2, std::memory_order_release);
+}
+#endif
+
+void FuncProfilerTree::stackCount(StringView counterName, double value)
+{
+    auto &counters = mBranchPtrStack.back()->mCounters;
+    auto counterIt = counters.find(counterName);
+    if (counterIt == counters.end())
+    {
+        // Out of budget, accumulate into the overflow counter
+        bool inserted;
+        std::tie(counterIt, inserted) =
+            counters.try_emplace(String(overBudget() ? OverflowBranchName : counterName), 0.0);
+        if (inserted)
+        {
+            mByteCount += counterByteSize(counterIt->first);
+        }
+    }
+    counterIt->second += value;
+}
+
+void FuncProfilerTree::setSlowCallCount(std::size_t callCount)
+{
+    mSlowCallCount = callCount;
+
+    // Let every branch reach the cold path to adopt the new count
+    std::vector<FuncProfilerTree *> branchPtrs = {this};
+    while (!branchPtrs.empty())
+    {
+        auto branchPtr = branchPtrs.back();
+        branchPtrs.pop_back();
+        branchPtr->mSlowCallThreshold = Time::duration::zero();
+        for (auto &nameBranchPair : branchPtr->mBranches)
+        {
+            branchPtrs.push_back(&nameBranchPair.second);
+        }
+    }
+}
+
+void FuncProfilerTree::recordSlowCall(FuncProfilerTree &branch, Time startTime, Time::duration duration)
+{
+    auto &heap = branch.mSlowCallHeap;
+
+    if (branch.mSlowCallCapacity != mSlowCallCount)
+    {
+        branch.mSlowCallCapacity = mSlowCallCount;
+        while (heap.size() > mSlowCallCount)
+        {
+            std::pop_heap(heap.begin(), heap.end(), isSlowerCall);
+            heap.pop_back();
+        }
+        if (heap.capacity() < mSlowCallCount)
+        {
+            mByteCount += (mSlowCallCount - heap.capacity()) * sizeof(SlowCall);
+            heap.reserve(mSlowCallCount);
+        }
+    }
+
+    if (mSlowCallCount == 0)
+    {
+        branch.mSlowCallThreshold = Time::duration::max();
+        return;
+    }
+
+    if (heap.size() == mSlowCallCount)
+    {
+        if (Duration(duration) <= heap.front().duration)
+        {
+            branch.mSlowCallThreshold = duration_cast<Time::duration>(heap.front().duration);
+            return;
+        }
+        std::pop_heap(heap.begin(), heap.end(), isSlowerCall);
+        mByteCount -= stringHeapSize(heap.back().tag);
+        heap.pop_back();
+    }
+
+    heap.push_back({startTime, std::this_thread::get_id(), duration, mSlowCallTag});
+    mByteCount += stringHeapSize(heap.back().tag);
+    std::push_heap(heap.begin(), heap.end(), isSlowerCall);
+
+    if (heap.size() == mSlowCallCount)
+    {
+        branch.mSlowCallThreshold = duration_cast<Time::duration>(heap.front().duration);
+    }
+}
+
+std::vector<SlowCall> FuncProfilerTree::slowCalls() const
+{
+    auto ret = mSlowCallHeap;
+    std::sort(ret.begin(), ret.end(), isSlowerCall);
+    return ret;
 }
 
 void FuncProfilerTree::reset()
@@ -45,9 +478,27 @@ void FuncProfilerTree::reset()
     mDuration = Duration::zero();
     mChoreDuration = Duration::zero();
     mCount = 0;
+    mReentryCount = 0;
+    mMaxRecursionDepth = 0;
+    mCollapsedCount = 0;
+    mActiveCount = 0;
     mBranches.clear();
+    mCounters.clear();
+    mSlowCallHeap.clear();
+    mSlowCallCapacity = 0;
+    mSlowCallThreshold = Time::duration::zero();
     mBranchPtrStack.clear();
     mBranchPtrStack.push_back(this);
+    mFrameStack.clear();
+    mActiveNames.clear();
+    mNodeCount = 0;
+    mByteCount = 0;
+#if MMETER_SHARED_MEMORY == 1
+    if (mSharedHeaderPtr != nullptr)
+    {
+        mSharedHeaderPtr->slotCount.store(0, std::memory_order_release);
+    }
+#endif
 }
 
 void FuncProfilerTree::merge(const FuncProfilerTree &tree)
@@ -55,6 +506,26 @@ void FuncProfilerTree::merge(const FuncProfilerTree &tree)
     mDuration += tree.mDuration;
     mChoreDuration += tree.mChoreDuration;
     mCount += tree.mCount;
+    mReentryCount += tree.mReentryCount;
+    mMaxRecursionDepth = std::max(mMaxRecursionDepth, tree.mMaxRecursionDepth);
+    mCollapsedCount += tree.mCollapsedCount;
+
+    for (auto &nameValuePair : tree.mCounters)
+    {
+        mCounters[nameValuePair.first] += nameValuePair.second;
+    }
+
+    mSlowCallCapacity = std::max(mSlowCallCapacity, tree.mSlowCallCapacity);
+    for (auto &slowCall : tree.mSlowCallHeap)
+    {
+        mSlowCallHeap.push_back(slowCall);
+        std::push_heap(mSlowCallHeap.begin(), mSlowCallHeap.end(), isSlowerCall);
+        if (mSlowCallHeap.size() > mSlowCallCapacity)
+        {
+            std::pop_heap(mSlowCallHeap.begin(), mSlowCallHeap.end(), isSlowerCall);
+            mSlowCallHeap.pop_back();
+        }
+    }
 
     for (auto &nameBranchPair : tree.mBranches)
     {
@@ -62,14 +533,61 @@ void FuncProfilerTree::merge(const FuncProfilerTree &tree)
     }
 }
 
+std::size_t FuncProfilerTree::branchByteSize(const String &branchName, const FuncProfilerTree &branch)
+{
+    std::size_t size = MapNodeOverhead + sizeof(String) + stringHeapSize(branchName) + sizeof(FuncProfilerTree) +
+                       branch.mBranchPtrStack.capacity() * sizeof(FuncProfilerTree *) +
+                       branch.mFrameStack.capacity() * sizeof(FrameInfo);
+
+    for (auto &nameValuePair : branch.mCounters)
+    {
+        size += counterByteSize(nameValuePair.first);
+    }
+    size += slowCallsByteSize(branch.mSlowCallHeap);
+
+    return size;
+}
+
+MemoryUsage FuncProfilerTree::branchesMemoryUsage() const
+{
+    MemoryUsage usage{0, 0};
+
+    for (auto &nameBranchPair : mBranches)
+    {
+        auto subUsage = nameBranchPair.second.branchesMemoryUsage();
+        usage.nodeCount += subUsage.nodeCount + 1;
+        usage.byteCount += subUsage.byteCount + branchByteSize(nameBranchPair.first, nameBranchPair.second);
+    }
+
+    return usage;
+}
+
+MemoryUsage FuncProfilerTree::memoryUsage() const
+{
+    auto usage = branchesMemoryUsage();
+    usage.byteCount += sizeof(FuncProfilerTree) + mBranchPtrStack.capacity() * sizeof(FuncProfilerTree *) +
+                       mFrameStack.capacity() * sizeof(FrameInfo);
+
+    for (auto &nameValuePair : mCounters)
+    {
+        usage.byteCount += counterByteSize(nameValuePair.first);
+    }
+    usage.byteCount += slowCallsByteSize(mSlowCallHeap);
+
+    return usage;
+}
+
 std::map<StringView, Results> FuncProfilerTree::totals() const
 {
     std::map<StringView, Results> ret;
 
     for (auto &nameBranchPair : mBranches)
     {
-        ret.emplace(nameBranchPair.first,
-                    Results(nameBranchPair.first, nameBranchPair.second.realDuration(), nameBranchPair.second.mCount));
+        auto &result =
+            ret.emplace(nameBranchPair.first, Results(nameBranchPair.first, nameBranchPair.second.realDuration(),
+                                                      nameBranchPair.second.mCount))
+                .first->second;
+        result.counters.insert(nameBranchPair.second.mCounters.begin(), nameBranchPair.second.mCounters.end());
     }
     if (mDuration.count() > 0)
     {
@@ -91,6 +609,10 @@ std::map<StringView, Results> FuncProfilerTree::totals() const
             {
                 it->second.realDuration += nameResultPair.second.realDuration;
                 it->second.callCount += nameResultPair.second.callCount;
+                for (auto &nameValuePair : nameResultPair.second.counters)
+                {
+                    it->second.counters[nameValuePair.first] += nameValuePair.second;
+                }
             }
         }
     }
@@ -138,7 +660,9 @@ String FuncProfilerTree::totalsStr(size_t indent, size_t indentSpaces) const
             }
         }
 
-        ss << '+' << name << ": " << result.realDuration.count() << "s /#" << result.callCount << std::endl;
+        ss << '+' << name << ": " << result.realDuration.count() << "s /#" << result.callCount;
+        outputCounters(ss, result.counters, result.realDuration);
+        ss << std::endl;
     }
 
     return ss.str();
@@ -162,7 +686,9 @@ String FuncProfilerTree::totalsByDurationStr(size_t indent, size_t indentSpaces)
             }
         }
 
-        ss << '+' << duration.count() << "s /#" << result.callCount << " - " << result.branchName << std::endl;
+        ss << '+' << duration.count() << "s /#" << result.callCount << " - " << result.branchName;
+        outputCounters(ss, result.counters, duration);
+        ss << std::endl;
     }
 
     return ss.str();
@@ -203,7 +729,12 @@ void FuncProfilerTree::outputBranchDurationsToOStream(std::ostream &out, size_t
             }
             else
             {
-                out << durationPtrPair.second->second.mCount << " - " << durationPtrPair.second->first << std::endl;
+                out << durationPtrPair.second->second.mCount << " - " << durationPtrPair.second->first;
+                outputBranchNotes(out, durationPtrPair.second->second);
+                outputCounters(out, durationPtrPair.second->second.mCounters, durationPtrPair.first);
+                out << std::endl;
+
+                outputSlowCalls(out, durationPtrPair.second->second, indent + 1, indentSpaces);
                 durationPtrPair.second->second.outputBranchDurationsToOStream(out, indent + 1, indentSpaces);
             }
         }
@@ -263,37 +794,27 @@ void FuncProfilerTree::outputBranchPercentagesToOStream(std::ostream &out, size_
                 {
                     out << "#" << durationPtrPair.second->second.mCount << " - ";
                 }
-                out << durationPtrPair.second->first << std::endl;
+                out << durationPtrPair.second->first;
+                outputBranchNotes(out, durationPtrPair.second->second);
+                out << std::endl;
+                outputSlowCalls(out, durationPtrPair.second->second, indent + 1, indentSpaces);
                 durationPtrPair.second->second.outputBranchPercentagesToOStream(out, indent + 1, indentSpaces);
             }
         }
     }
 }
 
-std::ostream &operator<<(std::ostream &out, FuncProfilerTree &tree)
+std::ostream &operator<<(std::ostream &out, const MemoryUsage &usage)
 {
-    // out << tree.realDuration().count() << "s" << std::endl;
-    tree.outputBranchDurationsToOStream(out, 0);
+    out << usage.nodeCount << " nodes / " << usage.byteCount << "B";
     return out;
 }
 
-FuncProfiler::FuncProfiler(Time startTime, CString name, FuncProfilerTree *treePtr) : mTreePtr(treePtr)
-{
-    mStartTime = startTime;
-
-    mBranchPtr = &treePtr->stackPush(name);
-    mChoresDuration = std::chrono::system_clock::now() - mStartTime;
-}
-
-FuncProfiler::~FuncProfiler()
+std::ostream &operator<<(std::ostream &out, FuncProfilerTree &tree)
 {
-    auto endTime = std::chrono::system_clock::now();
-    mBranchPtr->mDuration += endTime - mStartTime;
-    mBranchPtr->mCount++;
-    auto parentBranchPtr = mTreePtr->stack()[mTreePtr->stack().size() - 2];
-    mTreePtr->stackPop();
-    mChoresDuration += std::chrono::system_clock::now() - endTime;
-    mBranchPtr->mChoreDuration += mChoresDuration;
+    // out << tree.realDuration().count() << "s" << std::endl;
+    tree.outputBranchDurationsToOStream(out, 0);
+    return out;
 }
 
 namespace
@@ -301,23 +822,132 @@ namespace
 
 FuncProfilerTree globalTree;
 std::recursive_mutex globalTreeMutex;
+// The trees of the running threads, for getThreadMemoryUsages
+std::map<std::thread::id, const FuncProfilerTree *> threadTreePtrs;
+
+#if MMETER_SHARED_MEMORY == 1
+std::atomic<std::uint64_t> nextSharedThreadIndex(0);
+
+void detachSharedSegmentInChild();
+#endif
 
 class ThreadFuncProfilerTreeWrapper
 {
   public:
-    ThreadFuncProfilerTreeWrapper() = default;
+    ThreadFuncProfilerTreeWrapper()
+    {
+        globalTreeMutex.lock();
+        threadTreePtrs[std::this_thread::get_id()] = &localTree;
+        globalTreeMutex.unlock();
+#if MMETER_SHARED_MEMORY == 1
+        openSharedSegment();
+#endif
+    }
     ~ThreadFuncProfilerTreeWrapper()
     {
+        Detail::threadLocalTreePtr = nullptr;
         globalTreeMutex.lock();
         globalTree.merge(localTree);
+        threadTreePtrs.erase(std::this_thread::get_id());
         globalTreeMutex.unlock();
+#if MMETER_SHARED_MEMORY == 1
+        closeSharedSegment();
+#endif
     }
 
     FuncProfilerTree localTree;
+
+#if MMETER_SHARED_MEMORY == 1
+    // A forked child would write to the parent's segment, and remove it on exit
+    void detachSharedSegment()
+    {
+        if (mSharedHeaderPtr != nullptr)
+        {
+            localTree.setSharedSegment(nullptr);
+            munmap(mSharedHeaderPtr, mSharedSize);
+            mSharedHeaderPtr = nullptr;
+        }
+    }
+
+  private:
+    // If the segment can't be created, the thread simply isn't published
+    void openSharedSegment()
+    {
+        static const bool atForkRegistered = (pthread_atfork(nullptr, nullptr, detachSharedSegmentInChild) == 0);
+        (void)atForkRegistered;
+
+        auto threadIndex = nextSharedThreadIndex.fetch_add(1, std::memory_order_relaxed);
+        mSharedName = Shared::segmentName(getpid(), threadIndex);
+        mSharedSize = Shared::segmentSize(MMETER_SHARED_MEMORY_SLOTS);
+
+        int fd = shm_open(mSharedName.c_str(), O_CREAT | O_TRUNC | O_RDWR, 0600);
+        if (fd < 0)
+        {
+            return;
+        }
+        if (ftruncate(fd, mSharedSize) != 0)
+        {
+            close(fd);
+            shm_unlink(mSharedName.c_str());
+            return;
+        }
+        void *ptr = mmap(nullptr, mSharedSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (ptr == MAP_FAILED)
+        {
+            shm_unlink(mSharedName.c_str());
+            return;
+        }
+
+        auto headerPtr = new (ptr) Shared::Header();
+        for (std::uint32_t i = 0; i < MMETER_SHARED_MEMORY_SLOTS; i++)
+        {
+            new (&Shared::slots(headerPtr)[i]) Shared::Slot();
+        }
+        headerPtr->version = Shared::Version;
+        headerPtr->headerSize = sizeof(Shared::Header);
+        headerPtr->slotSize = sizeof(Shared::Slot);
+        headerPtr->pid = getpid();
+        headerPtr->threadIndex = threadIndex;
+        headerPtr->slotCapacity = MMETER_SHARED_MEMORY_SLOTS;
+        // Viewers only trust segments with the magic number
+        std::atomic_thread_fence(std::memory_order_release);
+        headerPtr->magic = Shared::Magic;
+
+        mSharedHeaderPtr = headerPtr;
+        localTree.setSharedSegment(headerPtr);
+    }
+
+    void closeSharedSegment()
+    {
+        if (mSharedHeaderPtr != nullptr)
+        {
+            localTree.setSharedSegment(nullptr);
+            munmap(mSharedHeaderPtr, mSharedSize);
+            shm_unlink(mSharedName.c_str());
+            mSharedHeaderPtr = nullptr;
+        }
+    }
+
+    Shared::Header *mSharedHeaderPtr = nullptr;
+    String mSharedName;
+    std::size_t mSharedSize = 0;
+#endif
 };
 
 thread_local ThreadFuncProfilerTreeWrapper threadTreeWrapper;
 
+#if MMETER_SHARED_MEMORY == 1
+// Runs in the forking thread, the only one in the child, and only touches its wrapper if it exists
+void detachSharedSegmentInChild()
+{
+    if (Detail::threadLocalTreePtr != nullptr)
+    {
+        threadTreeWrapper.detachSharedSegment();
+    }
+}
+#endif
+
 } // namespace
 
 GlobalFuncProfilerTreePtr::GlobalFuncProfilerTreePtr()
@@ -345,9 +975,22 @@ GlobalFuncProfilerTreePtr getGlobalTreePtr()
     return GlobalFuncProfilerTreePtr();
 }
 
-FuncProfilerTree *getThreadLocalTreePtr()
+FuncProfilerTree *Detail::initThreadLocalTreePtr()
+{
+    threadLocalTreePtr = &threadTreeWrapper.localTree;
+    return threadLocalTreePtr;
+}
+
+std::map<std::thread::id, MemoryUsage> getThreadMemoryUsages()
 {
-    return &threadTreeWrapper.localTree;
+    std::lock_guard<std::recursive_mutex> lock(globalTreeMutex);
+
+    std::map<std::thread::id, MemoryUsage> ret;
+    for (auto &idTreePtrPair : threadTreePtrs)
+    {
+        ret[idTreePtrPair.first] = idTreePtrPair.second->budgetUsage();
+    }
+    return ret;
 }
 
 } // namespace MMeter
\ No newline at end of file
@@ -0,0 +1,382 @@
+/*
+Made by Mauricio Smit
+repository: https://github.com/LegendaryMauricius/MMeter
+
+A top-like live view of a running process profiled with MMETER_SHARED_MEMORY enabled.
+It only reads the shared-memory segments of the process, so the process doesn't need to cooperate.
+Usage: mmeter-top <pid> [refresh interval in ms] [number of rows]
+Build: c++ -std=c++17 -Iinclude tools/mmeter-top.cpp -o mmeter-top -lrt
+Note: segments are found by listing /dev/shm, as on Linux
+Note: branches are updated when their scopes exit, so scopes that are still running show no duration yet
+Note: segments older than the process are left over by a killed process with the same pid, and are skipped
+*/
+
+#include "MMeterShared.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace
+{
+
+using namespace MMeter;
+
+/**
+ * @brief How many times a slot is read while its writer is busy, before it's skipped for the refresh
+ */
+constexpr int MaxReadRetries = 100;
+
+struct SlotSnapshot
+{
+    std::uint32_t parentIndex;
+    std::string name;
+    std::uint64_t callCount;
+    std::uint64_t durationNs;
+    std::uint64_t choreDurationNs;
+    // The writer didn't finish updating the slot, e.g. because the process is stopped
+    bool stale;
+};
+
+struct BranchStats
+{
+    std::uint64_t callCount = 0;
+    double realDuration = 0.0;
+};
+
+/**
+ * @brief A read-only mapping of a thread's segment
+ */
+class SegmentView
+{
+  public:
+    SegmentView() = default;
+    SegmentView(const SegmentView &) = delete;
+    SegmentView &operator=(const SegmentView &) = delete;
+    ~SegmentView()
+    {
+        if (mHeaderPtr != nullptr)
+        {
+            munmap(const_cast<Shared::Header *>(mHeaderPtr), mSize);
+        }
+    }
+
+    bool open(const std::string &name, double minCreationTime)
+    {
+        int fd = shm_open(name.c_str(), O_RDONLY, 0);
+        if (fd < 0)
+        {
+            return false;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (std::size_t)st.st_size < sizeof(Shared::Header) ||
+            (double)st.st_ctim.tv_sec + st.st_ctim.tv_nsec * 1e-9 < minCreationTime)
+        {
+            close(fd);
+            return false;
+        }
+        void *ptr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (ptr == MAP_FAILED)
+        {
+            return false;
+        }
+        mHeaderPtr = static_cast<const Shared::Header *>(ptr);
+        mSize = st.st_size;
+
+        if (mHeaderPtr->magic != Shared::Magic || mHeaderPtr->version != Shared::Version ||
+            mHeaderPtr->headerSize != sizeof(Shared::Header) || mHeaderPtr->slotSize != sizeof(Shared::Slot) ||
+            mSize < Shared::segmentSize(mHeaderPtr->slotCapacity))
+        {
+            return false;
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return true;
+    }
+
+    std::vector<SlotSnapshot> read() const
+    {
+        std::vector<SlotSnapshot> ret;
+
+        auto slotCount = std::min(mHeaderPtr->slotCount.load(std::memory_order_acquire), mHeaderPtr->slotCapacity);
+        ret.reserve(slotCount);
+
+        for (std::uint32_t i = 0; i < slotCount; i++)
+        {
+            auto &slot = Shared::slots(mHeaderPtr)[i];
+            SlotSnapshot snapshot;
+            char name[Shared::NameCapacity];
+
+            // Seqlock read, retried a limited number of times while the owning thread is writing
+            snapshot.stale = true;
+            for (int retry = 0; retry < MaxReadRetries; retry++)
+            {
+                auto sequence = slot.sequence.load(std::memory_order_acquire);
+                if (sequence & 1)
+                {
+                    std::this_thread::yield();
+                    continue;
+                }
+                snapshot.parentIndex = slot.parentIndex;
+                std::memcpy(name, slot.name, sizeof(name));
+                snapshot.callCount = slot.callCount.load(std::memory_order_relaxed);
+                snapshot.durationNs = slot.durationNs.load(std::memory_order_relaxed);
+                snapshot.choreDurationNs = slot.choreDurationNs.load(std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (slot.sequence.load(std::memory_order_relaxed) == sequence)
+                {
+                    snapshot.stale = false;
+                    break;
+                }
+            }
+
+            name[sizeof(name) - 1] = '\0';
+            snapshot.name = name;
+            ret.push_back(std::move(snapshot));
+        }
+
+        return ret;
+    }
+
+  private:
+    const Shared::Header *mHeaderPtr = nullptr;
+    std::size_t mSize = 0;
+};
+
+/**
+ * @returns the start time of a process in seconds since the epoch, or 0 if unknown
+ * @note it is accurate to about a second, as the boot time is
+ */
+double processStartTime(std::uint64_t pid)
+{
+    // The process name in parentheses may contain spaces, the start time is the 20th field after it
+    std::ifstream statFile("/proc/" + std::to_string(pid) + "/stat");
+    std::string stat;
+    std::getline(statFile, stat);
+    auto nameEnd = stat.rfind(')');
+    if (nameEnd == std::string::npos)
+    {
+        return 0.0;
+    }
+    std::istringstream fields(stat.substr(nameEnd + 1));
+    std::string field;
+    for (int i = 0; i < 19; i++)
+    {
+        fields >> field;
+    }
+    unsigned long long startTicks;
+    if (!(fields >> startTicks))
+    {
+        return 0.0;
+    }
+
+    std::ifstream systemStatFile("/proc/stat");
+    std::string key;
+    unsigned long long bootTime;
+    while (systemStatFile >> key)
+    {
+        if (key == "btime" && systemStatFile >> bootTime)
+        {
+            return (double)bootTime + (double)startTicks / sysconf(_SC_CLK_TCK);
+        }
+        systemStatFile.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+    }
+    return 0.0;
+}
+
+std::vector<std::string> findSegmentNames(std::uint64_t pid)
+{
+    std::vector<std::string> ret;
+    auto prefix = Shared::segmentPrefix(pid);
+
+    if (auto dir = opendir("/dev/shm"))
+    {
+        while (auto entry = readdir(dir))
+        {
+            if (std::strncmp(entry->d_name, prefix.c_str(), prefix.size()) == 0)
+            {
+                ret.push_back(std::string("/") + entry->d_name);
+            }
+        }
+        closedir(dir);
+    }
+
+    return ret;
+}
+
+/**
+ * @brief Sums the branches of all threads by their paths
+ * @returns the number of skipped stale branches
+ * @note branches of stale slots are skipped with their subbranches, as their paths aren't known
+ */
+std::size_t collectBranches(const std::vector<SlotSnapshot> &slots, std::map<std::string, BranchStats> &branches)
+{
+    std::vector<std::string> paths(slots.size());
+    std::vector<std::uint64_t> branchChoreNs(slots.size(), 0);
+    std::vector<bool> stale(slots.size());
+    std::size_t staleCount = 0;
+
+    // Parents always have lower indices than their children
+    for (std::size_t i = 0; i < slots.size(); i++)
+    {
+        auto parentIndex = slots[i].parentIndex;
+        stale[i] = slots[i].stale || (parentIndex < i && stale[parentIndex]);
+        if (stale[i])
+        {
+            staleCount++;
+            continue;
+        }
+        paths[i] = (parentIndex < i) ? paths[parentIndex] + " / " + slots[i].name : slots[i].name;
+    }
+    for (std::size_t i = slots.size(); i-- > 0;)
+    {
+        if (stale[i])
+        {
+            continue;
+        }
+        branchChoreNs[i] += slots[i].choreDurationNs;
+        auto parentIndex = slots[i].parentIndex;
+        if (parentIndex < i)
+        {
+            branchChoreNs[parentIndex] += branchChoreNs[i];
+        }
+    }
+
+    for (std::size_t i = 0; i < slots.size(); i++)
+    {
+        if (stale[i])
+        {
+            continue;
+        }
+        auto &stats = branches[paths[i]];
+        stats.callCount += slots[i].callCount;
+        // Running scopes haven't published their duration, but their subbranches' chores are already known
+        stats.realDuration += std::max(0.0, ((double)slots[i].durationNs - (double)branchChoreNs[i]) * 1e-9);
+    }
+
+    return staleCount;
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        std::cerr << "Usage: " << argv[0] << " <pid> [refresh interval in ms] [number of rows]" << std::endl;
+        return 1;
+    }
+
+    std::uint64_t pid = std::stoull(argv[1]);
+    auto interval = std::chrono::milliseconds(argc > 2 ? std::stoul(argv[2]) : 1000);
+    std::size_t rowCount = argc > 3 ? std::stoul(argv[3]) : 20;
+
+    std::map<std::string, BranchStats> lastBranches;
+    auto lastTime = std::chrono::steady_clock::now();
+    bool hasLast = false;
+
+    for (;;)
+    {
+        if (kill(pid, 0) != 0 && errno == ESRCH)
+        {
+            std::cout << "Process " << pid << " has exited" << std::endl;
+            return 0;
+        }
+
+        // Allow for the boot time being rounded to seconds
+        auto minCreationTime = processStartTime(pid) - 1.0;
+
+        std::map<std::string, BranchStats> branches;
+        std::size_t threadCount = 0, staleCount = 0;
+        for (auto &segmentName : findSegmentNames(pid))
+        {
+            SegmentView segment;
+            if (segment.open(segmentName, minCreationTime))
+            {
+                staleCount += collectBranches(segment.read(), branches);
+                threadCount++;
+            }
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        // The first refresh has nothing to compare to
+        auto elapsed = hasLast ? std::chrono::duration<double>(now - lastTime).count() : 0.0;
+
+        // Hottest branches since the last refresh
+        struct Row
+        {
+            double load;
+            double callRate;
+            const std::string *pathPtr;
+            const BranchStats *statsPtr;
+        };
+        std::vector<Row> rows;
+        for (auto &pathStatsPair : branches)
+        {
+            auto lastIt = lastBranches.find(pathStatsPair.first);
+            double lastDuration = (lastIt == lastBranches.end()) ? 0.0 : lastIt->second.realDuration;
+            std::uint64_t lastCount = (lastIt == lastBranches.end()) ? 0 : lastIt->second.callCount;
+            double load = 0.0, callRate = 0.0;
+            if (elapsed > 0.0)
+            {
+                load = std::max(0.0, pathStatsPair.second.realDuration - lastDuration) / elapsed;
+                auto callCount = pathStatsPair.second.callCount;
+                callRate = (double)(callCount - std::min(callCount, lastCount)) / elapsed;
+            }
+            rows.push_back({load, callRate, &pathStatsPair.first, &pathStatsPair.second});
+        }
+        std::sort(rows.begin(), rows.end(), [](const Row &a, const Row &b) {
+            return a.load != b.load ? a.load > b.load : a.statsPtr->realDuration > b.statsPtr->realDuration;
+        });
+
+        std::cout << "\x1b[H\x1b[2J";
+        std::cout << "MMeter - pid " << pid << " - " << threadCount << " threads - " << branches.size() << " branches";
+        if (staleCount > 0)
+        {
+            std::cout << " - " << staleCount << " stale branches skipped";
+        }
+        std::cout << std::endl << std::endl;
+        std::cout << std::setw(8) << "LOAD%" << std::setw(12) << "CALLS/S" << std::setw(14) << "TOTAL S"
+                  << std::setw(12) << "CALLS" << "  BRANCH" << std::endl;
+        std::cout << std::fixed;
+        for (std::size_t i = 0; i < rows.size() && i < rowCount; i++)
+        {
+            std::cout << std::setw(8) << std::setprecision(1) << rows[i].load * 100.0 << std::setw(12)
+                      << std::setprecision(0) << rows[i].callRate << std::setw(14) << std::setprecision(3)
+                      << rows[i].statsPtr->realDuration << std::setw(12) << rows[i].statsPtr->callCount << "  "
+                      << *rows[i].pathPtr << std::endl;
+        }
+        std::cout << std::defaultfloat << std::flush;
+
+        // Keep the last values of skipped branches, so they don't show a spike once they're read again
+        if (staleCount > 0)
+        {
+            branches.insert(lastBranches.begin(), lastBranches.end());
+        }
+        lastBranches = std::move(branches);
+        lastTime = now;
+        hasLast = true;
+        std::this_thread::sleep_for(interval);
+    }
+}